@@ -20,8 +20,16 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+// Ask for clock_gettime() where it is available.
+#if defined(__unix__) || defined(__APPLE__)
+    #define _POSIX_C_SOURCE 199309L
+#endif
+
 #include "limen.h"
 
+#include <stdint.h>
+#include <time.h>
+
 #if DEBUG >= 1
 size_t bytes = 0;
 #endif
@@ -47,6 +55,7 @@ void initByteArray(ByteArray *array) {
     array->pointer = NULL;
 
     array->capacity = 0;
+    array->grown = 0;
     array->count = 0;
     array->index = 0;
 }
@@ -62,11 +71,19 @@ void writeByteArray(ByteArray *array, Byte value) {
         }
 
         array->values = GROW_ARRAY(Byte, array->values, capacity, array->capacity);
+        array->grown++;
     }
 
     array->values[array->count++] = value;
 }
 
+void clearByteArray(ByteArray *array) {
+    array->pointer = NULL;
+
+    array->count = 0;
+    array->index = 0;
+}
+
 void freeByteArray(ByteArray *array) {
     FREE_ARRAY(Byte, array->values, array->capacity);
 
@@ -74,61 +91,386 @@ void freeByteArray(ByteArray *array) {
     array->pointer = NULL;
 
     array->capacity = 0;
+    array->grown = 0;
     array->count = 0;
     array->index = 0;
 }
 
+void initIntArray(IntArray *array) {
+    array->values = NULL;
+
+    array->capacity = 0;
+    array->grown = 0;
+    array->count = 0;
+}
+
+void writeIntArray(IntArray *array, int value) {
+    if (array->capacity < array->count + 1) {
+        int capacity = array->capacity;
+
+        if (capacity < ARRAY_GROW_THRESHOLD) {
+            array->capacity = ARRAY_GROW_THRESHOLD;
+        } else {
+            array->capacity = capacity * ARRAY_GROW_FACTOR;
+        }
+
+        array->values = GROW_ARRAY(int, array->values, capacity, array->capacity);
+        array->grown++;
+    }
+
+    array->values[array->count++] = value;
+}
+
+void clearIntArray(IntArray *array) {
+    array->count = 0;
+}
+
+void freeIntArray(IntArray *array) {
+    FREE_ARRAY(int, array->values, array->capacity);
+
+    array->values = NULL;
+
+    array->capacity = 0;
+    array->grown = 0;
+    array->count = 0;
+}
+
+int cellSize(Cell cell) {
+    switch (cell) {
+        case CELL_ASCII:
+        case CELL_BYTE:
+            return sizeof(Byte);
+        case CELL_SHORT:
+            return sizeof(uint16_t);
+        case CELL_INT:
+            return sizeof(uint32_t);
+    }
+
+    return sizeof(Byte);
+}
+
+unsigned long readCell(State *state, int index) {
+    switch (state->tape) {
+        case CELL_ASCII:
+        case CELL_BYTE:
+            return state->stream.values[index];
+        case CELL_SHORT:
+            return ((uint16_t *)state->stream.values)[index];
+        case CELL_INT:
+            return ((uint32_t *)state->stream.values)[index];
+    }
+
+    return 0;
+}
+
+// Grow the stream to <count> values of its cell model, new values are zero.
+static void growStream(State *state, int count) {
+    int size = cellSize(state->tape);
+
+    if (state->stream.capacity < count) {
+        int capacity = state->stream.capacity;
+
+        if (capacity < ARRAY_GROW_THRESHOLD) {
+            state->stream.capacity = ARRAY_GROW_THRESHOLD;
+        } else {
+            state->stream.capacity = capacity * ARRAY_GROW_FACTOR;
+        }
+
+        while (state->stream.capacity < count) {
+            state->stream.capacity *= ARRAY_GROW_FACTOR;
+        }
+
+        state->stream.values =
+            GROW_ARRAY(Byte, state->stream.values, capacity * size, state->stream.capacity * size);
+        state->stream.grown++;
+    }
+
+    for (int i = state->stream.count * size; i < count * size; i++) {
+        state->stream.values[i] = 0;
+    }
+
+    state->stream.count = count;
+}
+
+// Free the stream, its capacity is in values of its cell model.
+static void freeStream(State *state) {
+    FREE_ARRAY(Byte, state->stream.values, state->stream.capacity * cellSize(state->tape));
+
+    initByteArray(&state->stream);
+}
+
+void initMetrics(Metrics *metrics) {
+    metrics->lex = 0;
+    metrics->validate = 0;
+    metrics->run = 0;
+
+    for (int i = 0; i <= OPCODE_MASK; i++) {
+        metrics->ops[i] = 0;
+    }
+
+    metrics->stream = 0;
+    metrics->response = 0;
+    metrics->reallocations = 0;
+}
+
 void initState(State *state) {
     initByteArray(&state->prompt);
     initByteArray(&state->instructions);
     initByteArray(&state->stream);
     initByteArray(&state->response);
+    initIntArray(&state->loops);
 
     state->parens = 0;
     state->commas = 0;
     state->brackets = 0;
 
+    state->low = 0;
+    state->high = 0;
+
+    state->cell = CELL_ASCII;
+    state->tape = CELL_ASCII;
+
+    state->memory = 0;
+    state->steps = 0;
+
+    state->metrics = NULL;
+
+    state->result = RESULT_UNKNOWN;
+}
+
+void resetState(State *state) {
+    clearByteArray(&state->prompt);
+    clearByteArray(&state->instructions);
+    clearByteArray(&state->stream);
+    clearByteArray(&state->response);
+    clearIntArray(&state->loops);
+
+    state->parens = 0;
+    state->commas = 0;
+    state->brackets = 0;
+
+    state->low = 0;
+    state->high = 0;
+
     state->result = RESULT_UNKNOWN;
 }
 
 void freeState(State *state) {
     freeByteArray(&state->prompt);
     freeByteArray(&state->instructions);
-    freeByteArray(&state->stream);
+    freeStream(state);
     freeByteArray(&state->response);
+    freeIntArray(&state->loops);
 
     state->parens = 0;
     state->commas = 0;
     state->brackets = 0;
 
+    state->low = 0;
+    state->high = 0;
+
+    state->cell = CELL_ASCII;
+    state->tape = CELL_ASCII;
+
+    state->memory = 0;
+    state->steps = 0;
+
+    state->metrics = NULL;
+
     state->result = RESULT_UNKNOWN;
 }
 
+// Encode an instruction into <bytes> in its dense encoding, return how many bytes it takes up.
+static int encodeInstruction(Byte bytes[INSTRUCTION_SIZE_MAX], OpCode opcode, int operand) {
+    // If the operand fits, pack it next to the opcode.
+    if (operand < OPERAND_VARINT) {
+        bytes[0] = (Byte)(opcode | (operand << OPCODE_BITS));
+        return 1;
+    }
+
+    // Otherwise mark the operand field and write the operand after the opcode as a varint.
+    int size = 0;
+    bytes[size++] = (Byte)(opcode | (OPERAND_VARINT << OPCODE_BITS));
+
+    while (operand > 127) {
+        bytes[size++] = (Byte)((operand & 127) | 128);
+        operand >>= 7;
+    }
+
+    bytes[size++] = (Byte)operand;
+
+    return size;
+}
+
+// Write an instruction into the instructions array in its dense encoding, return how many bytes
+// it takes up.
+static int writeInstruction(ByteArray *instructions, OpCode opcode, int operand) {
+    Byte bytes[INSTRUCTION_SIZE_MAX];
+    int size = encodeInstruction(bytes, opcode, operand);
+
+    for (int i = 0; i < size; i++) {
+        writeByteArray(instructions, bytes[i]);
+    }
+
+    return size;
+}
+
+// Write a [ whose operand is not known yet, in a fixed-width slot that closeLoop() fills in.
+static void openLoop(ByteArray *instructions) {
+    writeByteArray(instructions, (Byte)(OP_OPEN | (OPERAND_VARINT << OPCODE_BITS)));
+
+    for (int i = 1; i < INSTRUCTION_SIZE_MAX; i++) {
+        writeByteArray(instructions, '\0');
+    }
+}
+
+// Close the loop whose [ slot is at <start> and whose body takes up <body> bytes once compacted,
+// return how many bytes the whole loop takes up once compacted.
+static int closeLoop(ByteArray *instructions, int start, int body) {
+    Byte bytes[INSTRUCTION_SIZE_MAX];
+
+    // Both brackets jump over the body and the ], whose size depends on that distance; grow the
+    // size until the distance fits.
+    int size = 1;
+    int next = encodeInstruction(bytes, OP_CLOSE, body + size);
+
+    while (next != size) {
+        size = next;
+        next = encodeInstruction(bytes, OP_CLOSE, body + size);
+    }
+
+    for (int i = 0; i < size; i++) {
+        writeByteArray(instructions, bytes[i]);
+    }
+
+    // Fill in the slot of the [ with the distance as a varint padded with continuation bits, it
+    // reads the same as the shortest one.
+    int distance = body + size;
+
+    for (int i = 1; i < INSTRUCTION_SIZE_MAX - 1; i++) {
+        instructions->values[start + i] = (Byte)((distance & 127) | 128);
+        distance >>= 7;
+    }
+
+    instructions->values[start + INSTRUCTION_SIZE_MAX - 1] = (Byte)distance;
+
+    return encodeInstruction(bytes, OP_OPEN, body + size) + body + size;
+}
+
+// Read an instruction from its dense encoding, return a pointer to the next instruction.
+static Byte *readInstruction(Byte *pointer, OpCode *opcode, int *operand) {
+    *opcode = (OpCode)(*pointer & OPCODE_MASK);
+    *operand = *pointer >> OPCODE_BITS;
+    pointer++;
+
+    // If the operand did not fit, read it as a varint.
+    if (*operand == OPERAND_VARINT) {
+        int shift = 0;
+
+        *operand = 0;
+        while (*pointer & 128) {
+            *operand |= (*pointer & 127) << shift;
+            shift += 7;
+            pointer++;
+        }
+
+        *operand |= *pointer << shift;
+        pointer++;
+    }
+
+    return pointer;
+}
+
+// Re-encode every instruction in its shortest encoding in place, squeezing out the padding of
+// the [ slots.
+//
+// NOTE: Every instruction takes up at most as many bytes as before, so the one being written never
+//       overtakes the one being read and the whole pass is linear.
+static void compactInstructions(ByteArray *instructions) {
+    Byte bytes[INSTRUCTION_SIZE_MAX];
+    Byte *pointer = instructions->values;
+    Byte *end = instructions->values + instructions->count;
+    int count = 0;
+
+    while (pointer < end) {
+        OpCode opcode;
+        int operand;
+
+        pointer = readInstruction(pointer, &opcode, &operand);
+
+        int size = encodeInstruction(bytes, opcode, operand);
+
+        for (int i = 0; i < size; i++) {
+            instructions->values[count++] = bytes[i];
+        }
+    }
+
+    instructions->count = count;
+}
+
+// Nanoseconds elapsed since an arbitrary point in time, used to time the phases of evaluation.
+static long long now(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (long long)time.tv_sec * 1000000000 + time.tv_nsec;
+#else
+    // NOTE: Where there is no monotonic clock, fall back to processor time.
+    return (long long)clock() * 1000000000 / CLOCKS_PER_SEC;
+#endif
+}
+
+// How many times the arrays of a state reallocated to grow.
+static int countGrowths(State *state) {
+    return state->prompt.grown + state->instructions.grown + state->stream.grown +
+           state->response.grown + state->loops.grown;
+}
+
+// Whether the arrays of a state take up more bytes than its memory limit allows.
+static int exceedsMemory(State *state) {
+    if (state->memory == 0) {
+        return 0;
+    }
+
+    long size = (long)state->prompt.count + state->instructions.count +
+                 (long)cellSize(state->tape) * state->stream.count + state->response.count +
+                 (long)sizeof(int) * state->loops.count;
+
+    return size > state->memory;
+}
+
 #if DEBUG > 0
 static void debugPrintInstructions(State *state) {
-    for (int i = 0; i < state->instructions.count; i++) {
-        fprintf(stderr, "%c", state->instructions.values[i]);
-    }
+    // Characters of the opcodes, in the order they are declared.
+    const char *symbols = "+-><.,[]";
+
+    Byte *pointer = state->instructions.values;
+    int index = 0;
 
-    fprintf(stderr, " %i %i\n", state->instructions.count, state->instructions.capacity);
+    while (index < state->instructions.count) {
+        OpCode opcode;
+        int operand;
 
-    for (int i = 0; i < state->instructions.count; i++) {
-        if (i == state->instructions.index) {
+        if (index == state->instructions.index) {
             fprintf(stderr, "%c", '^');
-        } else {
-            fprintf(stderr, "%c", '-');
         }
+
+        pointer = readInstruction(pointer, &opcode, &operand);
+        index = (int)(pointer - state->instructions.values);
+
+        fprintf(stderr, "%c%i ", symbols[opcode], operand);
     }
 
-    fprintf(stderr, "\n");
+    fprintf(stderr, "%i %i\n", state->instructions.count, state->instructions.capacity);
 }
 
 static void debugPrintStream(State *state) {
     for (int i = 0; i < state->stream.count; i++) {
         if (i == state->stream.index) {
-            fprintf(stderr, "[*%i]", state->stream.values[i]);
+            fprintf(stderr, "[*%lu]", readCell(state, i));
         } else {
-            fprintf(stderr, "[%i]", state->stream.values[i]);
+            fprintf(stderr, "[%lu]", readCell(state, i));
         }
     }
 
@@ -144,7 +486,8 @@ static void debugPrintResponse(State *state) {
 }
 #endif
 
-void eval(State *state, const Byte *code, const Byte *data) {
+// Lex user code and data into validated instructions and prompt.
+static void lex(State *state, const Byte *code, const Byte *data) {
     // Lex-Parse-Compile time.
     //
     // At this phase we lex and parse user code right into validated instructions. Effectively
@@ -168,15 +511,26 @@ void eval(State *state, const Byte *code, const Byte *data) {
     // Terminate the prompt array by writing a NULL character.
     writeByteArray(&state->prompt, '\0');
 
+    // The opcode of the run being folded and how many times it repeats so far.
+    OpCode run = OP_ADD;
+    int length = 0;
+    // How many bytes the instructions take up once compacted, the [ slots counted in their shortest
+    // encoding.
+    int size = 0;
+
     // Copy user code into the instructions array, validate it, character by character, stop if the
     // current character is the NULL character.
     //
     // NOTE: As an optimization, instead of copying characters, write opcodes, they enable
-    //       parse-compile-time optimizations; writing a special opcode that replaces a sequence of
-    //       instructions that do the same thing simplifies the run-time.
+    //       parse-compile-time optimizations; runs of the same instruction are folded into a single
+    //       instruction that repeats them and brackets carry the distance to their match instead
+    //       of searching for it at run time.
     while (*code != '\0') {
         // Skip non ASCII characters.
         if (*code <= 127 && *code >= 32) {
+            // The opcode of the current character if it folds into a run, otherwise -1.
+            int opcode = -1;
+
             // Skip every character besides the eight instructions.
             switch (*code) {
                 case '(': {
@@ -220,71 +574,132 @@ void eval(State *state, const Byte *code, const Byte *data) {
                     break;
                 }
                 case '+': {
-                    writeByteArray(&state->instructions, '+');
+                    opcode = OP_ADD;
                     break;
                 }
                 case '-': {
-                    writeByteArray(&state->instructions, '-');
+                    opcode = OP_SUB;
                     break;
                 }
                 case '>': {
-                    writeByteArray(&state->instructions, '>');
+                    opcode = OP_RIGHT;
                     break;
                 }
                 case '<': {
-                    writeByteArray(&state->instructions, '<');
+                    opcode = OP_LEFT;
                     break;
                 }
                 case '.': {
-                    writeByteArray(&state->instructions, '.');
+                    opcode = OP_OUTPUT;
                     break;
                 }
                 case ',': {
                     // Decrement the comma counter.
                     state->commas--;
-                    writeByteArray(&state->instructions, ',');
+                    opcode = OP_INPUT;
                     break;
                 }
                 case '[': {
                     // Increment the bracket counter.
                     state->brackets++;
-                    writeByteArray(&state->instructions, '[');
+
+                    // Write the run folded so far.
+                    if (length != 0) {
+                        size += writeInstruction(&state->instructions, run, length);
+                        length = 0;
+                    }
+
+                    // Open a new loop, the distance to its end is written when it is closed; until
+                    // then write a slot for it and remember where it is and how many bytes the
+                    // compacted instructions took up before it.
+                    writeIntArray(&state->loops, state->instructions.count);
+                    writeIntArray(&state->loops, size);
+                    openLoop(&state->instructions);
                     break;
                 }
                 case ']': {
                     // Decrement the bracket counter.
                     state->brackets--;
-                    writeByteArray(&state->instructions, ']');
+
+                    // Write the run folded so far.
+                    if (length != 0) {
+                        size += writeInstruction(&state->instructions, run, length);
+                        length = 0;
+                    }
+
+                    // Close the innermost open loop, if there is none, brackets are mismatched
+                    // and it is reported after lexing.
+                    if (state->loops.count != 0) {
+                        int before = state->loops.values[--state->loops.count];
+                        int start = state->loops.values[--state->loops.count];
+
+                        size = before + closeLoop(&state->instructions, start, size - before);
+                    }
                     break;
                 }
             }
+
+            // Fold the current instruction into the run.
+            if (opcode != -1) {
+                // If it is a different instruction, write the run folded so far.
+                if (length != 0 && (OpCode)opcode != run) {
+                    size += writeInstruction(&state->instructions, run, length);
+                    length = 0;
+                }
+
+                run = (OpCode)opcode;
+                length++;
+            }
         }
 
         // Step one character.
         code++;
     }
 
-    // Terminate the instructions array by writing a NULL character.
-    writeByteArray(&state->instructions, '\0');
+    // Write the last run.
+    if (length != 0) {
+        size += writeInstruction(&state->instructions, run, length);
+    }
 
-    // Grow the stream by writing a Null character.
-    writeByteArray(&state->stream, '\0');
+    // Squeeze the [ slots into their shortest encoding, now that every distance is known.
+    compactInstructions(&state->instructions);
+
+    // If the stream was grown with another cell model, start over with an empty one.
+    if (state->tape != state->cell) {
+        // Keep counting how many times the stream grew for the metrics.
+        int grown = state->stream.grown;
+
+        freeStream(state);
+        state->tape = state->cell;
+        state->stream.grown = grown;
+    }
+
+    // Grow the stream by one value, unless a previous evaluation already did.
+    if (state->stream.count == 0) {
+        growStream(state, 1);
+    }
+
+    // Nothing was visited yet besides the value at the stream pointer.
+    state->low = state->stream.index;
+    state->high = state->stream.index;
 
     // Set prompt pointer to point at the first value in the prompt.
     state->prompt.pointer = &state->prompt.values[0];
     // Set instructions pointer to point at the first instruction.
-    state->instructions.pointer = &state->instructions.values[0];
-    // Set stream pointer to point at the first value on the stream.
-    state->stream.pointer = &state->stream.values[0];
+    state->instructions.pointer = state->instructions.values;
+    // Set stream pointer to point at the value where the previous evaluation left it.
+    state->stream.pointer = &state->stream.values[state->stream.index * cellSize(state->tape)];
+}
 
+// Validate lexed instructions and prompt.
+static Result validate(State *state) {
     // If there are mismatched parens.
     if (state->parens != 0) {
         // Set the paren counter back to zero.
         state->parens = 0;
 
         // Error.
-        state->result = RESULT_MISMATCHED_PARENS;
-        return;
+        return RESULT_MISMATCHED_PARENS;
     }
 
     // If there are mismatched commas.
@@ -293,208 +708,126 @@ void eval(State *state, const Byte *code, const Byte *data) {
         state->commas = 0;
 
         // Error.
-        state->result = RESULT_MISMATCHED_COMMAS;
-        return;
+        return RESULT_MISMATCHED_COMMAS;
     }
 
-    // If there are mismatched brackets.
-    if (state->brackets != 0) {
+    // If there are mismatched brackets or a loop was closed before it was opened.
+    if (state->brackets != 0 || state->loops.count != 0) {
         // Set the bracket counter back to zero.
         state->brackets = 0;
 
         // Error.
-        state->result = RESULT_MISMATCHED_BRACKETS;
-        return;
+        return RESULT_MISMATCHED_BRACKETS;
     }
 
-    // Run time.
-    //
-    // At this phase we run validated instructions evaluating them into a response. Effectively
-    // manipulating the stream and writing a response.
-
-    // Run isntructions, stop at the NULL character.
-    while (*state->instructions.pointer != '\0') {
-#if DEBUG >= 1
-        debugPrintInstructions(state);
-#endif
+    // If the validated prompt and instructions alone do not fit in memory.
+    if (exceedsMemory(state)) {
+        // Error.
+        return RESULT_NOT_ENOUGH_MEMORY;
+    }
 
-        // Run the current instruction.
-        switch (*state->instructions.pointer) {
-            // Increment the value at the stream pointer.
-            case '+': {
-                // Ensure that the value wraps around to zero after reaching its maximum.
-                //
-                // TODO: Consider ensuring at the dynamic array implementation level.
-                *state->stream.pointer = (*state->stream.pointer + 1) & VALUE_MAX;
-                break;
-            }
-            // Decrement the value at the stream pointer.
-            case '-': {
-                // Ensure that the value wraps around to its maximum after reaching zero.
-                //
-                // TODO: Consider ensuring at the dynamic array implementation level.
-                *state->stream.pointer = (*state->stream.pointer - 1) & VALUE_MAX;
-                break;
-            }
-            // Move the stream pointer to the next value.
-            case '>': {
-                // Increment the stream index.
-                state->stream.index++;
-
-                // If we moved outside the stream.
-                if (state->stream.count <= state->stream.index) {
-                    // If we reached the maximum stream count.
-                    //
-                    // TODO: Consider checking at the dynamic array implementation level.
-                    if (state->stream.index > ARRAY_COUNT_MAX) {
-                        // Decrement the stream index.
-                        state->stream.index--;
-
-                        // Error.
-                        state->result = RESULT_ARRAY_OVERFLOW;
-                        return;
-                    }
+    return RESULT_OK;
+}
 
-                    // Grow the stream by writing a Null character.
-                    writeByteArray(&state->stream, '\0');
-                }
+// Specialize the run time loop for every cell model.
+#define CELL        Byte
+#define WRAP(value) ((CELL)((value) & VALUE_MAX))
+#define RUN         runAscii
+#include "run.inc"
+#undef CELL
+#undef WRAP
+#undef RUN
+
+#define CELL        Byte
+#define WRAP(value) ((CELL)(value))
+#define RUN         runByte
+#include "run.inc"
+#undef CELL
+#undef WRAP
+#undef RUN
+
+#define CELL        uint16_t
+#define WRAP(value) ((CELL)(value))
+#define RUN         runShort
+#include "run.inc"
+#undef CELL
+#undef WRAP
+#undef RUN
+
+#define CELL        uint32_t
+#define WRAP(value) ((CELL)(value))
+#define RUN         runInt
+#include "run.inc"
+#undef CELL
+#undef WRAP
+#undef RUN
+
+// Run validated instructions into a response, with the loop specialized for the cell model of the
+// stream.
+static Result run(State *state) {
+    switch (state->tape) {
+        case CELL_ASCII:
+            return runAscii(state);
+        case CELL_BYTE:
+            return runByte(state);
+        case CELL_SHORT:
+            return runShort(state);
+        case CELL_INT:
+            return runInt(state);
+    }
 
-                // Move the stream pointer forward on the stream.
-                state->stream.pointer++;
-                break;
-            }
-            // Move the stream pointer to the previous value.
-            case '<': {
-                // Decrement the stream index.
-                state->stream.index--;
-
-                // If we moved outside the stream.
-                //
-                // TODO: Consider checking at the dynamic array implementation level.
-                if (0 > state->stream.index) {
-                    // Set the stream index back to zero.
-                    state->stream.index = 0;
-
-                    // Error.
-                    state->result = RESULT_ARRAY_UNDERFLOW;
-                    return;
-                }
+    return RESULT_UNKNOWN;
+}
 
-                // Move the stream pointer backward on the stream.
-                state->stream.pointer--;
-                break;
-            }
-            // Write the value at the stream pointer into the response array.
-            case '.': {
-                writeByteArray(&state->response, *state->stream.pointer);
+void eval(State *state, const Byte *code, const Byte *data) {
+    // Metrics to fill in, if any, where the clock stood when the current phase started and how many
+    // times the arrays grew before.
+    Metrics *metrics = state->metrics;
+    long long time = 0;
+    int grown = countGrowths(state);
+
+    if (metrics != NULL) {
+        initMetrics(metrics);
+        time = now();
+    }
 
-#if DEBUG >= 1
-                debugPrintResponse(state);
-#endif
+    // Start from an empty prompt, instructions and response. The stream and its pointer are kept.
+    clearByteArray(&state->prompt);
+    clearByteArray(&state->instructions);
+    clearByteArray(&state->response);
+    clearIntArray(&state->loops);
 
-                break;
-            }
-            // Set the value at the stream pointer to the value at the prompt pointer.
-            case ',': {
-                *state->stream.pointer = *state->prompt.pointer;
-                // Increment the prompt index.
-                state->prompt.index++;
-                // Move the prompt pointer forward.
-                state->prompt.pointer++;
-                break;
-            }
-            // Jumps to the matching ].
-            case '[': {
-                // If the value at the stream pointer is zero.
-                if (*state->stream.pointer == 0) {
-                    // Increment the instructions index.
-                    state->instructions.index++;
-                    // Move the instructions pointer forward past the ] instruction.
-                    state->instructions.pointer++;
+    state->parens = 0;
+    state->commas = 0;
+    state->brackets = 0;
 
-                    // Increment the bracket counter.
-                    state->brackets++;
-                    // Move the instructions pointer forward while the brackets counter is not zero.
-                    while (state->brackets != 0) {
-                        // If the current instruction is a [.
-                        if (*state->instructions.pointer == '[') {
-                            // Increment the bracket counter.
-                            state->brackets++;
-                        }
+    lex(state, code, data);
 
-                        // If the current instruction is a ].
-                        if (*state->instructions.pointer == ']') {
-                            // Decrement the bracket counter.
-                            state->brackets--;
-                        }
+    if (metrics != NULL) {
+        metrics->lex = now() - time;
+        time += metrics->lex;
+    }
 
-                        // Increment the instructions index.
-                        state->instructions.index++;
-                        // Move the instructions pointer forward.
-                        state->instructions.pointer++;
-                    }
-                }
-                break;
-            }
-            // Jumps to the matching [.
-            case ']': {
-                // If the value at the stream pointer is not zero.
-                if (*state->stream.pointer != 0) {
-                    // Decrement the instructions index.
-                    state->instructions.index--;
-                    // Move the instructions pointer backward before the [ instruction.
-                    state->instructions.pointer--;
+    state->result = validate(state);
 
-                    // Increment the bracket counter.
-                    state->brackets++;
-                    // Move the instructions pointer backward while the brackets counter is not
-                    // zero.
-                    while (state->brackets != 0) {
-                        // If the current instruction is a ].
-                        if (*state->instructions.pointer == ']') {
-                            // Increment the bracket counter.
-                            state->brackets++;
-                        }
+    if (metrics != NULL) {
+        metrics->validate = now() - time;
+        time += metrics->validate;
+    }
 
-                        // If the current instruction is a [.
-                        if (*state->instructions.pointer == '[') {
-                            // Decrement the bracket counter.
-                            state->brackets--;
-                        }
+    // Only run validated instructions.
+    if (state->result == RESULT_OK) {
+        state->result = run(state);
 
-                        // Decrement the instructions index.
-                        state->instructions.index--;
-                        // Move the instructions pointer backward.
-                        state->instructions.pointer--;
-                    }
-                }
-                break;
-            }
+        if (metrics != NULL) {
+            metrics->run = now() - time;
         }
-
-#if DEBUG >= 1
-        debugPrintStream(state);
-#endif
-
-        // Increment the instructions index.
-        state->instructions.index++;
-        // Move the instructions pointer to the next instruction.
-        state->instructions.pointer++;
     }
 
-    // Terminate the response array by writing a NULL character.
-    writeByteArray(&state->response, '\0');
-
-#if DEBUG >= 1
-    debugPrintInstructions(state);
-    debugPrintStream(state);
-
-    // Explicit cast because size_t has different sizes on 32-bit and 64-bit and we need a
-    // consistent type for the format string.
-    fprintf(stderr, "Allocated %lu bytes.\n", (unsigned long)bytes);
-#endif
-
-    // Evaluation was successfull.
-    state->result = RESULT_OK;
-    return;
+    if (metrics != NULL) {
+        metrics->stream = state->stream.count;
+        // Do not count the NULL character terminating a successfull response.
+        metrics->response = state->response.count - (state->result == RESULT_OK);
+        metrics->reallocations = countGrowths(state) - grown;
+    }
 }
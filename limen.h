@@ -39,6 +39,10 @@ extern "C" {
 #define ARRAY_GROW_THRESHOLD 8
 #define ARRAY_GROW_FACTOR    2
 #define VALUE_MAX            127  // TODO: It is used but at the wrong level of implementation.
+#define OPCODE_BITS          3
+#define OPCODE_MASK          7
+#define OPERAND_VARINT       31  // Operand field value that signals a trailing varint operand.
+#define INSTRUCTION_SIZE_MAX 6   // Most bytes an instruction takes up, with a 5-byte varint.
 
 typedef enum eResult {
     RESULT_OK,                 // Everything went fine.
@@ -54,7 +58,9 @@ typedef enum eResult {
                              // went above those values.
     RESULT_ARRAY_UNDERFLOW,  // An Array erased a NULL value or its pointer offset went
                              // below zero.
-    RESULT_NOT_ENOUGH_MEMORY,  // Not enough memory. TODO: Not used. Use it!
+    RESULT_NOT_ENOUGH_MEMORY,  // Not enough memory. The arrays of the state would take up more
+                               // bytes than its memory limit allows.
+    RESULT_OUT_OF_STEPS,       // Ran more instructions than the step limit of the state allows.
     RESULT_UNKNOWN,            // Something went wrong and do not know why.
     RESULT_MAX,                // Used to track the size of the enum.
 } Result;
@@ -109,31 +115,116 @@ typedef struct sByteArray {
     int count;      // How many values are in this array?
     int index;      // Where are we in this array?
     int capacity;   // How many memory is allocated for this array.
+    int grown;      // How many times this array reallocated its values to grow.
     Byte *values;   // The values contained in this array.
     Byte *pointer;  // Pointer pointing at the current value in this array.
 } ByteArray;
 
 void initByteArray(ByteArray *array);
 void writeByteArray(ByteArray *array, Byte value);
+void clearByteArray(ByteArray *array);
 void freeByteArray(ByteArray *array);
 
+// A dynamic int array implementation, the same as the byte array above but without a pointer; used
+// for tables that are indexed directly.
+typedef struct sIntArray {
+    int count;     // How many values are in this array?
+    int capacity;  // How many memory is allocated for this array.
+    int grown;     // How many times this array reallocated its values to grow.
+    int *values;   // The values contained in this array.
+} IntArray;
+
+void initIntArray(IntArray *array);
+void writeIntArray(IntArray *array, int value);
+void clearIntArray(IntArray *array);
+void freeIntArray(IntArray *array);
+
+// An instruction opcode.
+//
+// Instructions are encoded densely: the opcode occupies the low OPCODE_BITS bits of a byte and its
+// operand the remaining high bits. Operands that do not fit, OPERAND_VARINT and above, set the
+// operand field to OPERAND_VARINT and follow the byte as a varint, seven bits per byte with the
+// high bit marking continuation. For runs the operand is how many times the instruction repeats,
+// for loops it is how many bytes to jump: from right after the [ to right after the matching ] and
+// back; so loops with short bodies fit in a single byte.
+typedef enum eOpCode {
+    OP_ADD,     // Increment the value at the stream pointer <operand> times.
+    OP_SUB,     // Decrement the value at the stream pointer <operand> times.
+    OP_RIGHT,   // Move the stream pointer <operand> values to the right.
+    OP_LEFT,    // Move the stream pointer <operand> values to the left.
+    OP_OUTPUT,  // Write the value at the stream pointer <operand> times.
+    OP_INPUT,   // Read <operand> values from the prompt, keep the last one.
+    OP_OPEN,    // Open a loop that ends <operand> bytes ahead.
+    OP_CLOSE,   // Close a loop whose body starts <operand> bytes behind.
+} OpCode;
+
+// Metrics of an evaluation, filled in when a state points to them.
+typedef struct sMetrics {
+    long long lex;       // Nanoseconds spent lexing user code and data.
+    long long validate;  // Nanoseconds spent validating the lexed instructions and prompt.
+    long long run;       // Nanoseconds spent running the validated instructions.
+
+    long long ops[OPCODE_MASK + 1];  // How many instructions of each opcode were run.
+
+    int stream;         // How many values the stream grew to.
+    int response;       // How many values were written to the response.
+    int reallocations;  // How many times the arrays of the state reallocated to grow.
+} Metrics;
+
+void initMetrics(Metrics *metrics);
+
+// A cell model, how wide the values on the stream are and where they wrap around.
+typedef enum eCell {
+    CELL_ASCII,  // 7-bit values that wrap around after 127, the default.
+    CELL_BYTE,   // 8-bit values that wrap around after 255.
+    CELL_SHORT,  // 16-bit values that wrap around after 65535.
+    CELL_INT,    // 32-bit values that wrap around after 4294967295.
+} Cell;
+
+// How many bytes a value of a cell model takes up on the stream.
+int cellSize(Cell cell);
+
 typedef struct sState {
     ByteArray prompt;        // Validated prompt read from user data.
     ByteArray instructions;  // Validated instructions read from user code.
-    ByteArray stream;        // Stream for the validated instructions to operate on.
+    ByteArray stream;        // Stream for the validated instructions to operate on. Its count,
+                             // index and capacity are in values of the cell model it was grown
+                             // with, which may be wider than a byte.
     ByteArray response;      // Response of the validated instructions.
+    IntArray loops;          // Offset of the [ slot of every loop left open while lexing, each
+                             // followed by how many bytes the compacted instructions took before
+                             // it.
 
     int parens;    // Mismatched paren count for error checks.
     int commas;    // Mismatched comma count for error checks.
     int brackets;  // Mismatched bracket count for error checks and loop management.
 
+    int low;   // Lowest stream index visited by the last evaluation.
+    int high;  // Highest stream index visited by the last evaluation.
+
+    Cell cell;  // Cell model of the instructions, set before evaluation.
+    Cell tape;  // Cell model the stream was grown with. A stream of another model is dropped.
+
+    long memory;  // Maximum number of bytes the arrays may take up, zero means no limit.
+    long steps;   // Maximum number of instructions of user code to run, zero means no limit.
+
+    Metrics *metrics;  // Metrics to fill in during evaluation or NULL to skip measuring.
+
     Result result;  // Result of evaluation.
 } State;
 
 void initState(State *state);
+// Empty a state, stream included, while keeping its allocated memory and limits.
+void resetState(State *state);
 void freeState(State *state);
 
+// Read the value at <index> on the stream of a state.
+unsigned long readCell(State *state, int index);
+
 // Evaluate provided user code and data into a response.
+//
+// Every evaluation lexes, validates and runs only the code and data it is given, against the stream
+// and stream pointer left behind by the previous evaluation of the same state.
 void eval(State *state, const Byte *code, const Byte *data);
 
 #ifdef __cplusplus
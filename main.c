@@ -1,64 +1,328 @@
+// Ask for syscall() where hardware counters are available.
+#ifdef __linux__
+    #define _DEFAULT_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+#ifdef _WIN32
+    #include <fcntl.h>
+    #include <io.h>
+#endif
 
 #include "limen.h"
 
-int main(int argc, const char *argv[]) {
+// Hardware counters reported with --stats where they are available.
+#define COUNTER_MAX 3
+
+// Skip <length> bytes of a frame. Return 0 if the stream ends before that.
+static int skipFrame(FILE *stream, unsigned long length) {
+    Byte buffer[4096];
+
+    while (length != 0) {
+        size_t chunk = length < sizeof(buffer) ? (size_t)length : sizeof(buffer);
+
+        if (fread(buffer, 1, chunk, stream) != chunk) {
+            return 0;
+        }
+
+        length -= chunk;
+    }
+
+    return 1;
+}
+
+// Read a frame, a big-endian 32-bit length followed by that many bytes, into <array> and terminate
+// it with a NULL character. Return 1 on success, 0 at the end of the stream before the frame and -1
+// if the frame is truncated. Return 2 if the frame, with its NULL character, is longer than <limit>
+// bytes, unless it is zero, or does not fit in memory; then the frame is skipped and <array> is
+// left as it was.
+static int readFrame(FILE *stream, ByteArray *array, long limit) {
+    Byte header[4];
+    size_t read = fread(header, 1, 4, stream);
+
+    // If the stream ended cleanly between frames.
+    if (read == 0) {
+        return 0;
+    }
+
+    if (read != 4) {
+        return -1;
+    }
+
+    unsigned long length = (unsigned long)header[0] << 24 | (unsigned long)header[1] << 16 |
+                           (unsigned long)header[2] << 8 | (unsigned long)header[3];
+
+    // Check the length against the limit before allocating anything for the frame; it is too long
+    // as well if it can not be counted by an int.
+    int fits = length < INT_MAX && (limit == 0 || length < (unsigned long)limit);
+
+    // Grow the array to fit the frame and its NULL character. Keep the old values if it fails.
+    if (fits && (unsigned long)array->capacity < length + 1) {
+        Byte *values = GROW_ARRAY(Byte, array->values, array->capacity, length + 1);
+
+        if (values == NULL) {
+            fits = 0;
+        } else {
+            array->values = values;
+            array->capacity = (int)(length + 1);
+        }
+    }
+
+    if (!fits) {
+        return skipFrame(stream, length) ? 2 : -1;
+    }
+
+    if (fread(array->values, 1, length, stream) != length) {
+        return -1;
+    }
+
+    array->values[length] = '\0';
+    array->count = (int)length + 1;
+
+    return 1;
+}
+
+// Write a response frame: the result code as a single byte followed by a big-endian 32-bit length
+// and that many bytes of response.
+static void writeFrame(FILE *stream, Result result, const Byte *values, unsigned long length) {
+    putc(result, stream);
+    putc((int)(length >> 24 & 255), stream);
+    putc((int)(length >> 16 & 255), stream);
+    putc((int)(length >> 8 & 255), stream);
+    putc((int)(length & 255), stream);
+    fwrite(values, 1, length, stream);
+}
+
+// Evaluate framed jobs read from stdin, each a code frame followed by a data frame, and write a
+// response frame to stdout for each; reusing a single state so its memory is allocated only once.
+static int serve(long memory, long steps, Cell cell) {
     // Declare exit code.
-    int ex;
+    int ex = 0;
 
-    // Declare user code and data.
-    const Byte *code;
-    const Byte *data;
+    // Declare and initialize state and the buffers of user code and data.
+    State state;
+    ByteArray code;
+    ByteArray data;
 
-    // Initialize user code and data, return early in case of incorrect usage.
-    switch (argc) {
-        case 1: {
-            // TODO: Implement the REPL.
-            code = (const Byte *)"";
-            data = (const Byte *)"";
+    initState(&state);
+    initByteArray(&code);
+    initByteArray(&data);
+
+#ifdef _WIN32
+    // Frames are binary, keep Windows from translating line endings and stopping at a 0x1A byte.
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    for (;;) {
+        int status = readFrame(stdin, &code, memory);
+
+        // Stop at the end of the stream.
+        if (status == 0) {
             break;
         }
-        case 2: {
-            code = (const Byte *)argv[1];
-            data = (const Byte *)"";
+
+        // Read the data even if the code was skipped, so the next job starts where it should.
+        int other = status == -1 ? -1 : readFrame(stdin, &data, memory);
+
+        // If the job is truncated.
+        if (status == -1 || other == -1 || other == 0) {
+            fprintf(stderr, "Error: Malformed job.\n");
+            // Set exit code to EX_DATAERR: The input data was incorrect.
+            ex = 65;
             break;
         }
-        case 3: {
-            code = (const Byte *)argv[1];
-            data = (const Byte *)argv[2];
-            break;
+
+        // If the job does not fit in memory, respond without evaluating it and go on.
+        if (status == 2 || other == 2) {
+            writeFrame(stdout, RESULT_NOT_ENOUGH_MEMORY, (const Byte *)"", 0);
+            fflush(stdout);
+            continue;
         }
-        default:
-            fprintf(stderr, "Usage: %s <code> <data>\n", argv[0]);
-            // Set exit code to EX_USAGE: The command was used incorrectly.
-            ex = 64;
-            // Return exit code.
-            return ex;
+
+        // Empty the state from the previous job and apply the limits.
+        resetState(&state);
+        state.memory = memory;
+        state.steps = steps;
+        state.cell = cell;
+
+        // Run eval on the job, altering state.
+        eval(&state, code.values, data.values);
+
+        // Respond with the result and, when it is OK, the response without its NULL character.
+        if (state.result == RESULT_OK) {
+            writeFrame(stdout, state.result, state.response.values,
+                       (unsigned long)state.response.count - 1);
+        } else {
+            writeFrame(stdout, state.result, (const Byte *)"", 0);
+        }
+
+        fflush(stdout);
     }
 
-    // Declare state.
-    State state;
+    // Free state and buffers.
+    freeByteArray(&data);
+    freeByteArray(&code);
+    freeState(&state);
 
-    // Initialize state.
-    initState(&state);
+    // Return exit code.
+    return ex;
+}
 
-    // Run eval on a piece of code, altering state.
-    eval(&state, code, data);
+// Open and start the hardware counters of this process: cycles, instructions and branch misses.
+// Counters that are not available are set to -1.
+static void startCounters(int counters[COUNTER_MAX]) {
+#ifdef __linux__
+    unsigned long long configs[COUNTER_MAX] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
 
-    // Check result, visualize response, report errors and set exit code based on what happened.
-    switch (state.result) {
-        case RESULT_OK: {
-            // Visualize stream.
-            for (int i = 0; i < state.stream.count; i++) {
-                if (i == state.stream.index) {
-                    fprintf(stdout, "[*%i]", state.stream.values[i]);
-                } else {
-                    fprintf(stdout, "[%i]", state.stream.values[i]);
-                }
+    for (int i = 0; i < COUNTER_MAX; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        counters[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+        if (counters[i] != -1) {
+            ioctl(counters[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#else
+    for (int i = 0; i < COUNTER_MAX; i++) {
+        counters[i] = -1;
+    }
+#endif
+}
+
+// Stop and close the hardware counters, reading their values. Values of counters that are not
+// available are set to -1.
+static void stopCounters(int counters[COUNTER_MAX], long long values[COUNTER_MAX]) {
+    for (int i = 0; i < COUNTER_MAX; i++) {
+        values[i] = -1;
+
+#ifdef __linux__
+        if (counters[i] != -1) {
+            ioctl(counters[i], PERF_EVENT_IOC_DISABLE, 0);
+
+            if (read(counters[i], &values[i], sizeof(values[i])) != sizeof(values[i])) {
+                values[i] = -1;
             }
-            fprintf(stdout, "\n");
-            // Visualize response.
-            fprintf(stdout, "%s\n", state.response.values);
+
+            close(counters[i]);
+        }
+#endif
+    }
+}
+
+// Print metrics and hardware counter values of an evaluation.
+static void printStats(FILE *stream, Metrics *metrics, long long values[COUNTER_MAX]) {
+    const char *symbols = "+-><.,[]";
+    const char *names[COUNTER_MAX] = {"Cycles", "Instructions", "Branch misses"};
+
+    fprintf(stream, "Lex: %lld ns\n", metrics->lex);
+    fprintf(stream, "Validate: %lld ns\n", metrics->validate);
+    fprintf(stream, "Run: %lld ns\n", metrics->run);
+
+    fprintf(stream, "Ops:");
+    for (int i = 0; i <= OPCODE_MASK; i++) {
+        fprintf(stream, " %c%lld", symbols[i], metrics->ops[i]);
+    }
+    fprintf(stream, "\n");
+
+    fprintf(stream, "Stream: %i values\n", metrics->stream);
+    fprintf(stream, "Response: %i bytes\n", metrics->response);
+    fprintf(stream, "Reallocations: %i\n", metrics->reallocations);
+
+    for (int i = 0; i < COUNTER_MAX; i++) {
+        if (values[i] != -1) {
+            fprintf(stream, "%s: %lld\n", names[i], values[i]);
+        }
+    }
+}
+
+// Print how to use the program, return the exit code for incorrect usage.
+static int usage(const char *name) {
+    fprintf(stderr, "Usage: %s [--stats] [--cells <bits>] <code> <data>\n", name);
+    fprintf(stderr, "       %s [--cells <bits>]\n", name);
+    fprintf(stderr, "       %s [--cells <bits>] --serve <memory> <steps>\n", name);
+    // Set exit code to EX_USAGE: The command was used incorrectly.
+    return 64;
+}
+
+// Parse a limit, a non-negative decimal number that fits in a long. Return 0 if it is not one.
+static int parseLimit(const char *text, long *limit) {
+    char *end;
+
+    // Reject signs and whitespace, that strtol() would accept.
+    if (*text < '0' || *text > '9') {
+        return 0;
+    }
+
+    errno = 0;
+    *limit = strtol(text, &end, 10);
+
+    return *end == '\0' && errno != ERANGE;
+}
+
+// Parse the number of bits of a cell model: 7, 8, 16 or 32. Return 0 if there is no such model.
+static int parseCell(const char *bits, Cell *cell) {
+    long value;
+
+    // Reject anything but the exact number, like leading zeros or trailing characters.
+    if (*bits == '0' || !parseLimit(bits, &value)) {
+        return 0;
+    }
+
+    switch (value) {
+        case 7: {
+            *cell = CELL_ASCII;
+            return 1;
+        }
+        case 8: {
+            *cell = CELL_BYTE;
+            return 1;
+        }
+        case 16: {
+            *cell = CELL_SHORT;
+            return 1;
+        }
+        case 32: {
+            *cell = CELL_INT;
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+// Report errors of an evaluation, return the exit code based on what happened.
+static int report(Result result) {
+    // Declare exit code.
+    int ex;
+
+    switch (result) {
+        case RESULT_OK: {
             // Set exit code to EX_OK: Successful evaluation.
             ex = 0;
             break;
@@ -99,6 +363,12 @@ int main(int argc, const char *argv[]) {
             ex = 70;
             break;
         }
+        case RESULT_OUT_OF_STEPS: {
+            fprintf(stderr, "Error: Out of steps.\n");
+            // Set exit code to EX_SOFTWARE: An internal software error has been detected.
+            ex = 70;
+            break;
+        }
         case RESULT_UNKNOWN: {
             fprintf(stderr, "Error: Unknown error.\n");
             // Set exit code to EX_UNAVAILABLE:  Something did not work and do not know why.
@@ -112,6 +382,246 @@ int main(int argc, const char *argv[]) {
             break;
     }
 
+    // Return exit code.
+    return ex;
+}
+
+// Read a line from <stream> into <array> without its newline and terminate it with a NULL
+// character. Return 0 at the end of the stream.
+static int readLine(FILE *stream, ByteArray *array) {
+    int character = getc(stream);
+
+    if (character == EOF) {
+        return 0;
+    }
+
+    clearByteArray(array);
+
+    while (character != EOF && character != '\n') {
+        writeByteArray(array, (Byte)character);
+        character = getc(stream);
+    }
+
+    writeByteArray(array, '\0');
+
+    return 1;
+}
+
+// Read user code from stdin line by line and evaluate every line on its own against the same
+// stream, visualizing the values it changed and its response.
+static int repl(Cell cell) {
+    // Declare state, the buffers of user code and data and a copy of the stream as it was last
+    // visualized to tell which values changed.
+    State state;
+    ByteArray code;
+    ByteArray data;
+    ByteArray copy;
+
+    initState(&state);
+    initByteArray(&code);
+    initByteArray(&data);
+    initByteArray(&copy);
+
+    state.cell = cell;
+
+    for (;;) {
+        fprintf(stdout, "> ");
+        fflush(stdout);
+
+        if (!readLine(stdin, &code)) {
+            break;
+        }
+
+        // Run eval on the line without user data first, altering state.
+        clearByteArray(&data);
+        writeByteArray(&data, '\0');
+
+        eval(&state, code.values, data.values);
+
+        // If the lexer counted , instructions, commas are mismatched and nothing ran yet; ask for
+        // user data and run eval on the line again with it.
+        if (state.result == RESULT_MISMATCHED_COMMAS) {
+            fprintf(stdout, ", ");
+            fflush(stdout);
+
+            if (!readLine(stdin, &data)) {
+                break;
+            }
+
+            eval(&state, code.values, data.values);
+        }
+
+        // How many bytes a value takes up on the stream and in the copy.
+        int size = cellSize(state.tape);
+
+        // Visualize the values visited by the line that changed and the one at the stream pointer.
+        for (int i = state.low; i <= state.high; i++) {
+            // Grow the copy along with the stream.
+            while (copy.count < (i + 1) * size) {
+                writeByteArray(&copy, '\0');
+            }
+
+            Byte *value = &state.stream.values[i * size];
+
+            if (i == state.stream.index) {
+                fprintf(stdout, "%i:[*%lu] ", i, readCell(&state, i));
+            } else if (memcmp(&copy.values[i * size], value, size) != 0) {
+                fprintf(stdout, "%i:[%lu] ", i, readCell(&state, i));
+            }
+
+            memcpy(&copy.values[i * size], value, size);
+        }
+        fprintf(stdout, "\n");
+
+        // Visualize response or report errors.
+        if (state.result == RESULT_OK) {
+            fprintf(stdout, "%s\n", state.response.values);
+        } else {
+            report(state.result);
+        }
+    }
+
+    fprintf(stdout, "\n");
+
+    // Free state and buffers.
+    freeByteArray(&copy);
+    freeByteArray(&data);
+    freeByteArray(&code);
+    freeState(&state);
+
+    // Set exit code to EX_OK: The session ended.
+    return 0;
+}
+
+int main(int argc, const char *argv[]) {
+    // Declare exit code.
+    int ex;
+
+    // Report metrics of the evaluation if asked to.
+    int stats = 0;
+    // Run as a server if asked to.
+    int serving = 0;
+    // Cell model of the evaluation.
+    Cell cell = CELL_ASCII;
+
+    // Read flags and skip them, keeping the program name in front of the remaining arguments.
+    for (;;) {
+        // How many arguments the current flag takes up.
+        int skip = 0;
+
+        if (argc >= 2 && strcmp(argv[1], "--stats") == 0) {
+            stats = 1;
+            skip = 1;
+        } else if (argc >= 2 && strcmp(argv[1], "--cells") == 0) {
+            if (argc < 3 || !parseCell(argv[2], &cell)) {
+                return usage(argv[0]);
+            }
+
+            skip = 2;
+        } else if (argc >= 2 && strcmp(argv[1], "--serve") == 0) {
+            serving = 1;
+            skip = 1;
+        }
+
+        if (skip == 0) {
+            break;
+        }
+
+        argv[skip] = argv[0];
+        argv += skip;
+        argc -= skip;
+    }
+
+    // Run as a server with optional memory and step limits. Metrics are only reported for a single
+    // evaluation.
+    if (serving) {
+        long memory = 0;
+        long steps = 0;
+
+        if (stats || argc > 3 || (argc >= 2 && !parseLimit(argv[1], &memory)) ||
+            (argc >= 3 && !parseLimit(argv[2], &steps))) {
+            return usage(argv[0]);
+        }
+
+        return serve(memory, steps, cell);
+    }
+
+    // Declare user code and data.
+    const Byte *code;
+    const Byte *data;
+
+    // Initialize user code and data, return early in case of incorrect usage.
+    switch (argc) {
+        case 1: {
+            // Without arguments, drop into the REPL. Metrics are only reported for a single
+            // evaluation.
+            if (stats) {
+                return usage(argv[0]);
+            }
+
+            return repl(cell);
+        }
+        case 2: {
+            code = (const Byte *)argv[1];
+            data = (const Byte *)"";
+            break;
+        }
+        case 3: {
+            code = (const Byte *)argv[1];
+            data = (const Byte *)argv[2];
+            break;
+        }
+        default:
+            return usage(argv[0]);
+    }
+
+    // Declare state.
+    State state;
+
+    // Initialize state.
+    initState(&state);
+    state.cell = cell;
+
+    // Declare metrics and hardware counters.
+    Metrics metrics;
+    int counters[COUNTER_MAX];
+    long long values[COUNTER_MAX];
+
+    // Ask for metrics and start counting.
+    if (stats) {
+        state.metrics = &metrics;
+        startCounters(counters);
+    }
+
+    // Run eval on a piece of code, altering state.
+    eval(&state, code, data);
+
+    // Stop counting.
+    if (stats) {
+        stopCounters(counters, values);
+    }
+
+    // Report errors and set exit code based on what happened.
+    ex = report(state.result);
+
+    // Visualize stream and response.
+    if (state.result == RESULT_OK) {
+        for (int i = 0; i < state.stream.count; i++) {
+            if (i == state.stream.index) {
+                fprintf(stdout, "[*%lu]", readCell(&state, i));
+            } else {
+                fprintf(stdout, "[%lu]", readCell(&state, i));
+            }
+        }
+        fprintf(stdout, "\n");
+        fprintf(stdout, "%s\n", state.response.values);
+    }
+
+    // Report metrics.
+    if (stats) {
+        printStats(stderr, &metrics, values);
+    }
+
     // Free state.
     freeState(&state);
 